@@ -0,0 +1,211 @@
+/* fastgrep - a multi-threaded tool to search for files containing a pattern
+   Copyright (C) 2020, Andrew Howard, <divisionind.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "blockreader.h"
+
+#define LOCK(reader)   pthread_mutex_lock(&reader->mutex)
+#define UNLOCK(reader) pthread_mutex_unlock(&reader->mutex)
+
+static int block_grow(bblock_t *block, size_t size) {
+    char *data = realloc(block->data, size);
+    if (data == NULL)
+        return 1;
+
+    block->data = data;
+    block->size = size;
+    return 0;
+}
+
+static void *task_read(void *context) {
+    breader_t *reader = context;
+    char *carry = NULL;      // partial line left over from the previous block
+    size_t carryLen = 0;
+    int error = 0;
+    bool eof = false;
+
+    while (!eof && !error) {
+        // wait for a free block
+        LOCK(reader);
+        while (reader->stored == reader->count && !reader->eof)
+            pthread_cond_wait(&reader->cond, &reader->mutex);
+        eof = reader->eof; // consumer gave up
+        UNLOCK(reader);
+        if (eof)
+            break;
+
+        bblock_t *block = &reader->blocks[reader->write_idx];
+        if (carryLen > block->size && block_grow(block, carryLen * 2)) {
+            error = ENOMEM;
+            break;
+        }
+
+        if (carryLen)
+            memcpy(block->data, carry, carryLen); // carry is NULL until the first partial line
+        block->len = carryLen;
+        carryLen = 0;
+
+        // read until the block contains at least one full line
+        for (;;) {
+            if (block->len == block->size && block_grow(block, block->size * 2)) {
+                error = ENOMEM;
+                break;
+            }
+
+            ssize_t n = read(reader->fd, block->data + block->len, block->size - block->len);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                error = errno;
+                break;
+            }
+
+            if (n == 0) {
+                eof = true;
+                break;
+            }
+
+            size_t i = block->len + n;
+            while (i > block->len && block->data[i - 1] != '\n')
+                i--;
+
+            block->len += n;
+            if (i != block->len - n) {
+                carryLen = block->len - i;
+                char *newCarry = realloc(carry, carryLen ? carryLen : 1);
+                if (newCarry == NULL) {
+                    error = ENOMEM;
+                    break;
+                }
+
+                carry = newCarry;
+                memcpy(carry, block->data + i, carryLen);
+                block->len = i;
+                break;
+            }
+        }
+
+        // publish the block
+        LOCK(reader);
+        if (block->len && !error) {
+            reader->write_idx = (reader->write_idx + 1) % reader->count;
+            reader->stored++;
+        }
+        if (eof)
+            reader->eof = true;
+        reader->error = error;
+        pthread_cond_broadcast(&reader->cond);
+        UNLOCK(reader);
+    }
+
+    LOCK(reader);
+    reader->eof = true;
+    reader->error = error;
+    pthread_cond_broadcast(&reader->cond);
+    UNLOCK(reader);
+
+    free(carry);
+    return NULL;
+}
+
+int breader_create(breader_t *reader, int fd, size_t size, size_t count) {
+    reader->fd = fd;
+    reader->count = count;
+    reader->read_idx = 0;
+    reader->write_idx = 0;
+    reader->stored = 0;
+    reader->held = false;
+    reader->eof = false;
+    reader->error = 0;
+
+    reader->blocks = calloc(count, sizeof(bblock_t));
+    if (reader->blocks == NULL)
+        return 1;
+
+    for (size_t i = 0; i < count; i++) {
+        if (block_grow(&reader->blocks[i], size))
+            goto fail;
+    }
+
+    if (pthread_mutex_init(&reader->mutex, NULL))
+        goto fail;
+
+    if (pthread_cond_init(&reader->cond, NULL)) {
+        pthread_mutex_destroy(&reader->mutex);
+        goto fail;
+    }
+
+    if (pthread_create(&reader->thread, NULL, task_read, reader)) {
+        pthread_cond_destroy(&reader->cond);
+        pthread_mutex_destroy(&reader->mutex);
+        goto fail;
+    }
+
+    return 0;
+
+    fail:
+    for (size_t i = 0; i < count; i++)
+        free(reader->blocks[i].data);
+    free(reader->blocks);
+    return 1;
+}
+
+void breader_free(breader_t *reader) {
+    LOCK(reader);
+    reader->eof = true; // stops the reader if the stream was not consumed entirely
+    pthread_cond_broadcast(&reader->cond);
+    UNLOCK(reader);
+
+    pthread_join(reader->thread, NULL);
+    pthread_cond_destroy(&reader->cond);
+    pthread_mutex_destroy(&reader->mutex);
+
+    for (size_t i = 0; i < reader->count; i++)
+        free(reader->blocks[i].data);
+    free(reader->blocks);
+}
+
+int breader_next(breader_t *reader, char **data, size_t *len) {
+    LOCK(reader);
+
+    // hand the previous block back to the reader thread
+    if (reader->held) {
+        reader->read_idx = (reader->read_idx + 1) % reader->count;
+        reader->stored--;
+        reader->held = false;
+        pthread_cond_broadcast(&reader->cond);
+    }
+
+    while (reader->stored == 0 && !reader->eof)
+        pthread_cond_wait(&reader->cond, &reader->mutex);
+
+    if (reader->stored == 0) {
+        int ret = reader->error ? -1 : 1;
+        UNLOCK(reader);
+        return ret;
+    }
+
+    bblock_t *block = &reader->blocks[reader->read_idx];
+    *data = block->data;
+    *len = block->len;
+    reader->held = true;
+    UNLOCK(reader);
+    return 0;
+}
@@ -0,0 +1,64 @@
+/* fastgrep - a multi-threaded tool to search for files containing a pattern
+   Copyright (C) 2020, Andrew Howard, <divisionind.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#ifndef FASTGREP_BLOCKREADER_H
+#define FASTGREP_BLOCKREADER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t len;
+} bblock_t;
+
+/*
+ * Reads a stream in large blocks on a separate thread so reading and searching overlap. Every block
+ * handed out ends on a line boundary (or the end of the stream), blocks grow to fit lines longer than them.
+ */
+typedef struct {
+    int fd;
+    bblock_t *blocks;
+    size_t count;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    size_t read_idx;
+    size_t write_idx;
+    size_t stored;
+    bool held;  // the consumer still holds the block at read_idx
+    bool eof;
+    int error;
+} breader_t;
+
+int breader_create(breader_t *reader, int fd, size_t size, size_t count);
+
+void breader_free(breader_t *reader);
+
+int breader_next(breader_t *reader, char **data, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //FASTGREP_BLOCKREADER_H
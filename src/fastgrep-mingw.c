@@ -17,6 +17,8 @@
 #ifdef __MINGW32__
 
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
 
 #include "fastgrep-mingw.h"
 
@@ -24,10 +26,12 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 
 typedef intptr_t ssize_t;
 
-ssize_t getline(char **lineptr, size_t *n, FILE *stream) {
+ssize_t getdelim(char **lineptr, size_t *n, int delim, FILE *stream) {
     size_t pos;
     int c;
 
@@ -65,7 +69,7 @@ ssize_t getline(char **lineptr, size_t *n, FILE *stream) {
         }
 
         ((unsigned char *) (*lineptr))[pos++] = c;
-        if (c == '\n') {
+        if (c == delim) {
             break;
         }
         c = getc(stream);
@@ -75,6 +79,25 @@ ssize_t getline(char **lineptr, size_t *n, FILE *stream) {
     return pos;
 }
 
+ssize_t getline(char **lineptr, size_t *n, FILE *stream) {
+    return getdelim(lineptr, n, '\n', stream);
+}
+
+void *memmem(const void *haystack, size_t haystacklen, const void *needle, size_t needlelen) {
+    const char *pos = haystack;
+    const char *end = pos + haystacklen;
+
+    if (needlelen == 0)
+        return (void*) haystack;
+
+    while (end - pos >= (ptrdiff_t) needlelen && (pos = memchr(pos, *(const char*) needle, end - pos - needlelen + 1)) != NULL) {
+        if (!memcmp(pos, needle, needlelen))
+            return (void*) pos;
+        pos++;
+    }
+    return NULL;
+}
+
 long mingw_getprocessors() {
     SYSTEM_INFO info;
     GetSystemInfo(&info);
@@ -98,6 +121,10 @@ void mingw_enable_color() {
     }
 }
 
+void mingw_binary_stdout() {
+    _setmode(_fileno(stdout), _O_BINARY);
+}
+
 void mingw_fix_path(char *path) {
     char current;
     int i;
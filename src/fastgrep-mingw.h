@@ -27,14 +27,20 @@
 //#define realpath(x, y) _fullpath(x, y, _MAX_PATH) // fullpath only returned current working directory for some reason
 #define sysconf(x) mingw_getprocessors()
 
+ssize_t getdelim(char **lineptr, size_t *n, int delim, FILE *stream);
+
 ssize_t getline(char **lineptr, size_t *n, FILE *stream);
 
+void *memmem(const void *haystack, size_t haystacklen, const void *needle, size_t needlelen);
+
 long mingw_getprocessors();
 
 void mingw_enable_color();
 
 void mingw_fix_path(char *path);
 
+void mingw_binary_stdout();
+
 #endif
 
 #endif //FASTGREP_MINGW_H
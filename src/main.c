@@ -14,6 +14,7 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
 
+#define _GNU_SOURCE
 #define _XOPEN_SOURCE 700
 #define _LARGEFILE64_SOURCE
 #define _FILE_OFFSET_BITS 64
@@ -21,11 +22,15 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <malloc.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #ifndef __MINGW32__
@@ -36,27 +41,58 @@
 
 #include "strfifo.h"
 #include "stringbuilder.h"
+#include "resultcache.h"
+#include "blockreader.h"
+#include "shard.h"
 
 #define COLOR(x) ("\033[" x "m")
 #define RESET           COLOR("")
 #define COLOR_HIGHLIGHT COLOR("95")
 #define STR_LEN(x)      (sizeof(x) - 1)
-
+#define STDIN_PATH      "(standard input)"
+#define REPLACE_TEMP_SUFFIX ".fgXXXXXX"
+
+#define AFLAG_PRINT_STATS   (1<<8)
+#define AFLAG_SHARD_WORKER  (1<<7)
+#define AFLAG_REPLACE       (1<<6)
+#define AFLAG_STDIN_CONTENT (1<<5)
+#define AFLAG_STDIN_NULL    (1<<4)
+#define AFLAG_USE_CACHE     (1<<3)
 #define AFLAG_FROM_STDIN    (1<<2)
 #define AFLAG_USE_COLOR     (1<<1)
 #define AFLAG_PREVIEW_MATCH (1)
 
+#define OPT_CACHE      0x100
+#define OPT_CACHE_SIZE 0x101
+#define OPT_JSON       0x102
+#define OPT_NULL       0x103
+#define OPT_BINARY     0x104
+#define OPT_STDIN_DATA 0x105
+#define OPT_SHARDS     0x106
+#define OPT_SHARD_WORK 0x107
+#define OPT_STATS      0x108
+
+#define FORMAT_HUMAN  0
+#define FORMAT_JSON   1
+#define FORMAT_NULL   2
+#define FORMAT_BINARY 3
+
 struct {
     char *query;
     int fifoSize;
     int maxFileDesc;
     int directoryTrim;
     long threads;
+    int shards;
     char *directory;
     unsigned int flags;
     int previewBounds;
+    int format;
     char **extensions;
     int nExtensions;
+    char *replacement;
+    char *cachePath;
+    size_t cacheSize;
 } args;
 
 const char *argp_program_bug_address  = "<https://github.com/divisionind/fastgrep/issues>";
@@ -76,6 +112,17 @@ static struct argp_option options[] = {
     {"preview-bounds", 'b', "15",     0, "Amount of text on each side of the result to display in the preview"},
     {"version",        'v', 0,        0, "Print program version"},
     {"stdin",          'i', 0,        0, "Search files provided from stdin rather than a directory"},
+    {"stdin-null",     '0', 0,        0, "Like --stdin but the paths are separated by NUL rather than newlines (e.g. git ls-files -z)"},
+    {"replace",        'r', "STR",    0, "Replace every occurrence of [QUERY] with STR, files are rewritten in place (atomically)"},
+    {"stdin-content",  OPT_STDIN_DATA, 0,      0, "Search the content of stdin itself rather than files"},
+    {"shards",         OPT_SHARDS,     "N",    0, "Split the search across N worker processes pinned to NUMA nodes, the threads are divided between them"},
+    {"shard-worker",   OPT_SHARD_WORK, 0,      OPTION_HIDDEN, "Run as a shard worker: NUL-separated paths on stdin, framed results on stdout"},
+    {"stats",          OPT_STATS,      0,      0, "Print the number of files searched and matched and the bytes read to stderr"},
+    {"cache",          OPT_CACHE,      "FILE", 0, "Cache results in FILE, repeat searches only read files whose metadata changed"},
+    {"json",           OPT_JSON,       0,      0, "Print one JSON object per match with the path, line, column, byte offset and length"},
+    {"null",           OPT_NULL,       0,      0, "Print each match as NUL-terminated fields: path, line, column, byte offset, length"},
+    {"binary",         OPT_BINARY,     0,      0, "Print each match as a binary record (see README)"},
+    {"cache-size",     OPT_CACHE_SIZE, "64",   0, "Max size of the result cache in MB, applied when the cache is (re)created"},
     {0}
 };
 
@@ -108,6 +155,25 @@ static error_t parse_opt(int key, char *in, struct argp_state *state) {
         case 'i':
             args.flags |= AFLAG_FROM_STDIN;
             break;
+        case '0':
+            args.flags |= AFLAG_FROM_STDIN | AFLAG_STDIN_NULL;
+            break;
+        case 'r':
+            args.replacement = in;
+            args.flags |= AFLAG_REPLACE;
+            break;
+        case OPT_STDIN_DATA:
+            args.flags |= AFLAG_STDIN_CONTENT;
+            break;
+        case OPT_SHARDS:
+            args.shards = atoi(in);
+            break;
+        case OPT_SHARD_WORK:
+            args.flags |= AFLAG_FROM_STDIN | AFLAG_STDIN_NULL | AFLAG_SHARD_WORKER;
+            break;
+        case OPT_STATS:
+            args.flags |= AFLAG_PRINT_STATS;
+            break;
         case 'e': {
             int count = 1;
             char current;
@@ -129,6 +195,22 @@ static error_t parse_opt(int key, char *in, struct argp_state *state) {
         case 'b':
             args.previewBounds = atoi(in);
             break;
+        case OPT_CACHE:
+            args.cachePath = in;
+            args.flags |= AFLAG_USE_CACHE;
+            break;
+        case OPT_CACHE_SIZE:
+            args.cacheSize = (size_t) atol(in) << 20;
+            break;
+        case OPT_JSON:
+            args.format = FORMAT_JSON;
+            break;
+        case OPT_NULL:
+            args.format = FORMAT_NULL;
+            break;
+        case OPT_BINARY:
+            args.format = FORMAT_BINARY;
+            break;
         case ARGP_KEY_ARG:
             if (state->arg_num >= 1)
                 argp_usage(state);
@@ -148,11 +230,277 @@ static error_t parse_opt(int key, char *in, struct argp_state *state) {
 
 static struct argp arg_parser = {options, parse_opt, program_usage, program_desc};
 sfifo_t fifo;
+rcache_t cache;
+shard_t shard;
+static int (*put_path)(const char *path);
+
+static void write_output(const char *output, size_t len) {
+    if (args.flags & AFLAG_SHARD_WORKER)
+        shard_write_frame(stdout, SHARD_FRAME_OUTPUT, output, len);
+    else
+        fwrite(output, 1, len, stdout);
+}
+
+static void print_stats(const shard_stats_t *stats) {
+    if (args.flags & AFLAG_SHARD_WORKER)
+        shard_write_stats(stdout, stats);
+    else if (args.flags & AFLAG_PRINT_STATS)
+        fprintf(stderr, "searched %" PRIu64 " files (%" PRIu64 " bytes read), %" PRIu64 " files matched\n",
+                stats->files, stats->bytes_read, stats->matched_files);
+}
+
+// per search thread, merged once the threads are joined
+typedef struct {
+    shard_stats_t stats;
+    uint64_t failed_replaces;
+} search_result_t;
+
+typedef struct {
+    const char *path;
+    size_t pathLen;
+    uint64_t line;
+    uint64_t column; // zero based byte offset of the match within the line
+    uint64_t offset; // byte offset of the match within the file
+    uint64_t length;
+} match_t;
+
+static void format_human(stringbuilder_t *out, const match_t *match, char *lineBuffer, ssize_t lineLength) {
+    int color = (args.flags & AFLAG_USE_COLOR) && (args.flags & AFLAG_PREVIEW_MATCH);
+
+    if (color)
+        sb_append(out, "\033[1m", STR_LEN("\033[1m"));
+
+    sb_append(out, match->path, match->pathLen);
+    sb_append(out, ":", 1);
+    sb_append_uint(out, match->line);
+
+    if (color)
+        sb_append(out, RESET, STR_LEN(RESET));
+    sb_append(out, "\t", 1);
+
+    if (args.flags & AFLAG_PREVIEW_MATCH) {
+        // calculate preview bounds
+        int64_t startOffset, stopOffset;
+
+        startOffset = match->column;
+        stopOffset  = startOffset + match->length;
+        startOffset -= args.previewBounds;
+        stopOffset  += args.previewBounds;
+        if (startOffset < 0)
+            startOffset = 0;
+
+        if (stopOffset > lineLength)
+            stopOffset = lineLength;
+        // end of bound calculations
+
+        // limit characters to decent looking ascii (replacing with spaces)
+        for (ssize_t i = startOffset; i < stopOffset; i++) {
+            if (lineBuffer[i] < 0x20 || lineBuffer[i] > 0x7E) lineBuffer[i] = 0x20;
+        }
+
+        sb_append(out, " ", 1);
+        if (color) {
+            char* matchStart = lineBuffer + match->column;
+            char* matchStop  = matchStart + match->length;
+
+            sb_append(out, lineBuffer + startOffset, matchStart - (lineBuffer + startOffset));
+            sb_append(out, COLOR_HIGHLIGHT, STR_LEN(COLOR_HIGHLIGHT));
+            sb_append(out, matchStart, match->length);
+            sb_append(out, RESET, STR_LEN(RESET));
+            sb_append(out, matchStop, (lineBuffer + stopOffset) - matchStop);
+        } else {
+            sb_append(out, lineBuffer + startOffset, stopOffset - startOffset);
+        }
+    }
+
+    sb_append(out, "\n", 1);
+}
+
+static void format_json(stringbuilder_t *out, const match_t *match) {
+    sb_append(out, "{\"path\":\"", STR_LEN("{\"path\":\""));
+    sb_append_json(out, match->path, match->pathLen);
+    sb_append(out, "\",\"line\":", STR_LEN("\",\"line\":"));
+    sb_append_uint(out, match->line);
+    sb_append(out, ",\"column\":", STR_LEN(",\"column\":"));
+    sb_append_uint(out, match->column + 1);
+    sb_append(out, ",\"offset\":", STR_LEN(",\"offset\":"));
+    sb_append_uint(out, match->offset);
+    sb_append(out, ",\"length\":", STR_LEN(",\"length\":"));
+    sb_append_uint(out, match->length);
+    sb_append(out, "}\n", 2);
+}
+
+static void format_null(stringbuilder_t *out, const match_t *match) {
+    // path\0line\0column\0offset\0length\0
+    sb_append(out, match->path, match->pathLen + 1);
+    sb_append_uint(out, match->line);
+    sb_append(out, "", 1);
+    sb_append_uint(out, match->column + 1);
+    sb_append(out, "", 1);
+    sb_append_uint(out, match->offset);
+    sb_append(out, "", 1);
+    sb_append_uint(out, match->length);
+    sb_append(out, "", 1);
+}
+
+static void format_binary(stringbuilder_t *out, const match_t *match) {
+    // little endian u32 path length, u64 line, u64 column, u64 offset, u32 length, then the path bytes
+    sb_append_le(out, match->pathLen, 4);
+    sb_append_le(out, match->line, 8);
+    sb_append_le(out, match->column + 1, 8);
+    sb_append_le(out, match->offset, 8);
+    sb_append_le(out, match->length, 4);
+    sb_append(out, match->path, match->pathLen);
+}
+
+static void format_match(stringbuilder_t *out, const match_t *match, char *lineBuffer, ssize_t lineLength) {
+    switch (args.format) {
+        case FORMAT_JSON:
+            format_json(out, match);
+            break;
+        case FORMAT_NULL:
+            format_null(out, match);
+            break;
+        case FORMAT_BINARY:
+            format_binary(out, match);
+            break;
+        default:
+            format_human(out, match, lineBuffer, lineLength);
+    }
+}
+
+static int replace_line(stringbuilder_t *content, const char *lineBuffer, size_t lineLength, size_t queryLen) {
+    const char* pos = lineBuffer;
+    const char* end = lineBuffer + lineLength;
+    const char* matchStart;
+
+    while ((matchStart = memmem(pos, end - pos, args.query, queryLen)) != NULL) {
+        if (sb_append(content, pos, matchStart - pos) || sb_append(content, args.replacement, strlen(args.replacement)))
+            return 1;
+        pos = matchStart + queryLen;
+    }
+    return sb_append(content, pos, end - pos);
+}
+
+#ifndef __MINGW32__
+static void sync_directory(const char *filename) {
+    char dirname[PATH_MAX];
+    const char* slash = strrchr(filename, '/');
+
+    if (slash == NULL) {
+        strcpy(dirname, ".");
+    } else {
+        memcpy(dirname, filename, slash - filename + 1);
+        dirname[slash - filename + 1] = 0;
+    }
+
+    int fd = open(dirname, O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Atomically replaces the file with content, info is the fstat of the file taken before it was read. Returns NULL
+ * on success, otherwise the reason the file was left untouched.
+ */
+static const char *replace_file(const char *filename, const struct stat *info, stringbuilder_t *content) {
+    char tempname[PATH_MAX];
+    struct stat linkInfo;
+
+    if (lstat(filename, &linkInfo))
+        return strerror(errno);
+
+    // renaming over a symlink would replace the link itself and over a hard link would split it from its other names
+    if (S_ISLNK(linkInfo.st_mode))
+        return "symlink";
+
+    if (linkInfo.st_nlink > 1)
+        return "hard link";
+
+    // the file was replaced or written to since it was read, the content is stale
+    if (!rcache_same_file(&linkInfo, info))
+        return "changed while reading";
+
+    // the temp file must be in the same directory for the rename to be atomic
+    if (snprintf(tempname, sizeof(tempname), "%s" REPLACE_TEMP_SUFFIX, filename) >= (int) sizeof(tempname))
+        return "path too long";
+
+    int fd = mkstemp(tempname);
+    if (fd == -1)
+        return strerror(errno);
+
+    size_t written = 0;
+    while (written < content->offset) {
+        ssize_t n = write(fd, content->buffer + written, content->offset - written);
+        if (n < 0)
+            goto fail;
+        written += n;
+    }
+
+    if (fchown(fd, info->st_uid, info->st_gid)) {
+        // keep going, non-root users can not give files away
+    }
+
+    // the content must be on disk before the rename, or a crash could leave an empty file behind
+    if (fchmod(fd, info->st_mode & 07777) || fsync(fd))
+        goto fail;
+
+    if (close(fd)) {
+        fd = -1;
+        goto fail;
+    }
+
+    if (rename(tempname, filename)) {
+        const char* reason = strerror(errno);
+        unlink(tempname);
+        return reason;
+    }
+
+    sync_directory(filename);
+    return NULL;
+
+    fail: ;
+    const char* reason = strerror(errno);
+    if (fd != -1)
+        close(fd);
+    unlink(tempname);
+    return reason;
+}
+#else
+static const char *replace_file(const char *filename, const struct stat *info, stringbuilder_t *content) {
+    (void) filename;
+    (void) info;
+    (void) content;
+    return "not supported on this platform";
+}
+#endif
+
+// true for the temp files of replace_file(), the tree walk may pick them up while they exist
+static int is_replace_temp(const char *filename) {
+    size_t len = strlen(filename);
+    size_t suffixLen = STR_LEN(REPLACE_TEMP_SUFFIX);
+
+    if (len < suffixLen || strncmp(filename + len - suffixLen, REPLACE_TEMP_SUFFIX, suffixLen - 6))
+        return 0;
+
+    for (size_t i = len - 6; i < len; i++) {
+        if (!isalnum((unsigned char) filename[i]))
+            return 0;
+    }
+    return 1;
+}
 
 static void *task_search(void *context) {
-    (void) context;
+    search_result_t* result = context;
+    shard_stats_t* stats = &result->stats;
 
     char filename[PATH_MAX];
+    size_t queryLen = strlen(args.query);
+    struct stat info, openInfo;
+    stringbuilder_t* out = sb_create(4096); // output of the current file, written with a single fwrite
+    stringbuilder_t* replaced = (args.flags & AFLAG_REPLACE) ? sb_create(65536) : NULL; // new content of the current file
 
     while (!(fifo.closed && fifo.stored_bytes == 0)) {
         // aquire file from fifo
@@ -180,83 +528,89 @@ static void *task_search(void *context) {
         }
 
         search_file: ;
+        if ((args.flags & AFLAG_REPLACE) && is_replace_temp(filename))
+            continue;
+
+        // paths from stdin are validated here rather than on the producer so the stat calls run in parallel
+        if (args.flags & (AFLAG_USE_CACHE | AFLAG_FROM_STDIN)) {
+            if (stat(filename, &info) || !S_ISREG(info.st_mode)) // todo add symlinks later (if add follow symlinks opt)
+                continue;
+        }
+
+        if (args.flags & AFLAG_USE_CACHE) {
+            sb_reset(out);
+
+            // files with matches must still be read when replacing, only "no match" results can be skipped
+            if (!rcache_lookup(&cache, filename, &info, out) && !(out->offset && (args.flags & AFLAG_REPLACE))) {
+                stats->files++;
+                if (out->offset) {
+                    write_output(out->buffer, out->offset);
+                    stats->matched_files++;
+                }
+                continue;
+            }
+        }
+
         FILE* file = fopen(filename, "r");
-        unsigned int lineN = 0;
+        uint64_t lineN = 0;
+        uint64_t lineOffset = 0;
         size_t lineBufferSize = 0;
         char* lineBuffer = NULL;
         ssize_t lineLength;
 
         if (file != NULL) {
+            // any read or allocation failure would leave a truncated replacement, the file is not rewritten then
+            int replaceFailed = 0;
+
+            sb_reset(out);
+            if (replaced) {
+                sb_reset(replaced);
+                replaceFailed = fstat(fileno(file), &openInfo);
+            }
+
+            #ifdef __MINGW32__
+            mingw_fix_path(filename);
+            #endif
+
+            const char* path = filename + args.directoryTrim;
+            size_t pathLen = strlen(path);
+
             while ((lineLength = getline(&lineBuffer, &lineBufferSize, file)) != EOF) {
                 lineN++;
 
+                // build the new content before the preview formatting modifies the line
+                if (replaced && !replaceFailed)
+                    replaceFailed = replace_line(replaced, lineBuffer, lineLength, queryLen);
+
                 char* matchStart;
-                if ((matchStart = strstr(lineBuffer, args.query)) != NULL) {
+                if ((matchStart = memmem(lineBuffer, lineLength, args.query, queryLen)) != NULL) {
                     // line contained the search param
-                    stringbuilder_t* sb = NULL;       // dynamically allocated stringbuilder
-                    char* previewOutput;              // start of actual string passed to printf
-                    char* outputFormat = "%s:%i\t%s"; // format of the printf
-
-                    if (args.flags & AFLAG_PREVIEW_MATCH) {
-                        // calculate preview bounds
-                        int64_t startOffset, stopOffset;
-                        size_t queryLen = strlen(args.query);
-
-                        startOffset = matchStart - lineBuffer;
-                        stopOffset  = startOffset + queryLen;
-                        startOffset -= args.previewBounds;
-                        stopOffset  += args.previewBounds;
-                        if (startOffset < 0)
-                            startOffset = 0;
-
-                        if (stopOffset > lineLength)
-                            stopOffset = lineLength;
-                        // end of bound calculations
-
-                        // limit characters to decent looking ascii (replacing with spaces)
-                        for (size_t i = 0; i < lineLength; i++) {
-                            if (lineBuffer[i] < 0x20 || lineBuffer[i] > 0x7E) lineBuffer[i] = 0x20;
-                        }
-
-                        size_t previewLength = stopOffset - startOffset;
-
-                        if (args.flags & AFLAG_USE_COLOR) {
-                            sb = sb_create(previewLength + 2 + STR_LEN(COLOR_HIGHLIGHT) + STR_LEN(RESET));
-                            sb_append(sb, " ", 1);
-
-                            char* lineBuffPos = lineBuffer + startOffset;
-                            size_t curOffset; // could be zero
-                            sb_append(sb, lineBuffPos, curOffset = (matchStart - lineBuffPos));
-                            lineBuffPos += curOffset;
-
-                            sb_append(sb, COLOR_HIGHLIGHT, STR_LEN(COLOR_HIGHLIGHT));
-                            sb_append(sb, lineBuffPos, queryLen);
-                            lineBuffPos += queryLen;
-
-                            sb_append(sb, RESET, STR_LEN(RESET));
-                            sb_append(sb, lineBuffPos, stopOffset - (lineBuffPos - lineBuffer));
-
-                            outputFormat = "\033[1m%s:%i\033[m\t%s";
-                        } else {
-                            sb = sb_create(previewLength + 2);
-                            sb_append(sb, " ", 1);
-                            sb_append(sb, lineBuffer + startOffset, previewLength);
-                        }
-
-                        // add suffix return+nulterm
-                        sb_append(sb, "\n", 1);
-                        previewOutput = sb->buffer;
-                    } else {
-                        previewOutput = "\n";
-                    }
-
-                    #ifdef __MINGW32__
-                    mingw_fix_path(filename);
-                    #endif
-
-                    printf(outputFormat, filename + args.directoryTrim, lineN, previewOutput);
-                    sb_free(sb);
+                    match_t match = {path, pathLen, lineN, matchStart - lineBuffer, lineOffset + (matchStart - lineBuffer), queryLen};
+                    format_match(out, &match, lineBuffer, lineLength);
                 }
+
+                lineOffset += lineLength;
+            }
+
+            stats->files++;
+            stats->bytes_read += lineOffset;
+            if (out->offset) {
+                write_output(out->buffer, out->offset);
+                stats->matched_files++;
+            }
+
+            // files without matches are never written
+            if (replaced && out->offset) {
+                const char* reason = replaceFailed || ferror(file) ? "read failed" : replace_file(filename, &openInfo, replaced);
+                if (reason != NULL) {
+                    fprintf(stderr, "failed to replace matches in %s: %s\n", filename, reason);
+                    result->failed_replaces++;
+                }
+            }
+
+            // only cache the result if the file was not replaced while it was being read
+            else if ((args.flags & AFLAG_USE_CACHE) && !fstat(fileno(file), &openInfo) && rcache_same_file(&openInfo, &info)) {
+                rcache_store(&cache, filename, &info, out->buffer, out->offset);
             }
 
             free(lineBuffer);
@@ -264,25 +618,229 @@ static void *task_search(void *context) {
         }
     }
 
+    sb_free(out);
+    sb_free(replaced);
     return NULL;
 }
 
+static int search_stdin() {
+    shard_stats_t stats = {1, 0, 0};
+    breader_t reader;
+    stringbuilder_t* out = sb_create(4096);
+    size_t queryLen = strlen(args.query);
+    uint64_t lineN = 1;
+    uint64_t blockOffset = 0;
+    char* block;
+    size_t blockLen;
+    int ret;
+
+    if (out == NULL || breader_create(&reader, STDIN_FILENO, 1 << 20, 4)) {
+        fprintf(stderr, "insufficient memory or other resources\n");
+        sb_free(out);
+        return 1;
+    }
+
+    // blocks always end on a line boundary, so lines never span two of them
+    while (!(ret = breader_next(&reader, &block, &blockLen))) {
+        char* pos = block; // start of the first line not yet counted
+        char* end = block + blockLen;
+        char* matchStart;
+        char* newline;
+
+        sb_reset(out);
+        while (pos < end && (matchStart = memmem(pos, end - pos, args.query, queryLen)) != NULL) {
+            // count the lines before the one containing the match
+            char* lineStart = pos;
+            while ((newline = memchr(lineStart, '\n', matchStart - lineStart)) != NULL) {
+                lineStart = newline + 1;
+                lineN++;
+            }
+
+            char* lineEnd = memchr(matchStart, '\n', end - matchStart);
+            lineEnd = lineEnd ? lineEnd + 1 : end;
+
+            match_t match = {STDIN_PATH, STR_LEN(STDIN_PATH), lineN, matchStart - lineStart, blockOffset + (matchStart - block), queryLen};
+            format_match(out, &match, lineStart, lineEnd - lineStart);
+
+            // like the file search, only the first match of each line is reported
+            pos = lineEnd;
+            lineN++;
+        }
+
+        while (pos < end && (newline = memchr(pos, '\n', end - pos)) != NULL) {
+            pos = newline + 1;
+            lineN++;
+        }
+
+        if (out->offset) {
+            write_output(out->buffer, out->offset);
+            stats.matched_files = 1;
+        }
+        blockOffset += blockLen;
+    }
+
+    breader_free(&reader);
+    sb_free(out);
+
+    stats.bytes_read = blockOffset;
+    print_stats(&stats);
+
+    if (ret < 0) {
+        fprintf(stderr, "failed to read stdin\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int put_fifo(const char *path) {
+    while (sfifo_put(&fifo, path));
+    return 0;
+}
+
+static int put_shard(const char *path) {
+    return shard_put(&shard, path);
+}
+
 static int task_load_file_entry(const char *filename, const struct stat *info, int flag, struct FTW *pathInfo) {
     (void) info;
     (void) pathInfo;
 
     if (flag == FTW_F) {
-        while (sfifo_put(&fifo, filename));
+        return put_path(filename); // non zero stops the walk
     }
     return 0;
 }
 
+static void load_paths() {
+    if (args.flags & AFLAG_FROM_STDIN) {
+        char* lineBuffer = NULL;
+        size_t lineBufferSize = 0;
+        ssize_t lineLen;
+        int delim = (args.flags & AFLAG_STDIN_NULL) ? '\0' : '\n';
+
+        // paths are checked by the workers, only drop the ones that can not fit in the fifo
+        while ((lineLen = getdelim(&lineBuffer, &lineBufferSize, delim, stdin)) != EOF) {
+            if (lineLen && lineBuffer[lineLen - 1] == delim)
+                lineBuffer[--lineLen] = 0;
+
+            if (lineLen && lineLen < PATH_MAX && put_path(lineBuffer))
+                break;
+        }
+
+        free(lineBuffer);
+    } else {
+        nftw(args.directory, task_load_file_entry, args.maxFileDesc, FTW_PHYS); // max # open file descriptors, do not follow symlinks (todo maybe allow this? as an option)
+    }
+}
+
+static int run_search() {
+    shard_stats_t total = {0, 0, 0};
+    uint64_t failedReplaces = 0;
+
+    // done parsing args, create fifo
+    if (sfifo_create(&fifo, args.fifoSize, PATH_MAX)) {
+        fprintf(stderr, "insufficient memory or other resources\n");
+        return 1;
+    }
+
+    if (args.threads < 1) {
+        fprintf(stderr, "invalid processor configuration, 2 or more cores is required\n");
+        return 1;
+    }
+
+    if (args.flags & AFLAG_USE_CACHE) {
+        // every option that changes the output of a file must be part of the cache key
+        unsigned int outputFlags = args.flags & (AFLAG_PREVIEW_MATCH | AFLAG_USE_COLOR);
+        uint64_t optionsHash = rcache_hash(0, args.query, strlen(args.query) + 1);
+        optionsHash = rcache_hash(optionsHash, &outputFlags, sizeof(outputFlags));
+        optionsHash = rcache_hash(optionsHash, &args.previewBounds, sizeof(args.previewBounds));
+        optionsHash = rcache_hash(optionsHash, &args.format, sizeof(args.format));
+        optionsHash = rcache_hash(optionsHash, &args.directoryTrim, sizeof(args.directoryTrim));
+
+        int cacheStatus = rcache_open(&cache, args.cachePath, args.cacheSize, optionsHash);
+        if (cacheStatus) {
+            if (cacheStatus == RCACHE_NOT_A_CACHE)
+                fprintf(stderr, "%s is not a fastgrep cache, continuing without it\n", args.cachePath);
+            else
+                fprintf(stderr, "failed to open result cache, continuing without it\n");
+            args.flags &= ~AFLAG_USE_CACHE;
+        }
+    }
+
+    // init threads
+    pthread_t* threads = malloc(sizeof(pthread_t) * args.threads);
+    search_result_t* results = calloc(args.threads, sizeof(search_result_t));
+    for (int i = 0; i < args.threads; i++) {
+        pthread_create(&threads[i], NULL, task_search, &results[i]);
+    }
+
+    // iterate files and send them to the fifo
+    put_path = put_fifo;
+    load_paths();
+
+    // cleanup
+    sfifo_close(&fifo); // ensure it is closed before joining threads
+    for (int i = 0; i < args.threads; i++) {
+        pthread_join(threads[i], NULL);
+        total.files += results[i].stats.files;
+        total.matched_files += results[i].stats.matched_files;
+        total.bytes_read += results[i].stats.bytes_read;
+        failedReplaces += results[i].failed_replaces;
+    }
+    sfifo_free(&fifo);
+    if (args.flags & AFLAG_USE_CACHE)
+        rcache_close(&cache);
+
+    print_stats(&total);
+    free(threads);
+    free(results);
+
+    // lets scripts driving a replace detect files which were left untouched, workers pass this on as their exit status
+    return failedReplaces != 0;
+}
+
+static int run_shard_worker(size_t index, size_t count) {
+    // pin before anything is allocated so the worker's memory is local to its node
+    int cpus = shard_pin(index);
+
+    // the threads are split between the workers, a worker pinned to a node uses at most its cpus
+    long threads = args.threads / (long) count;
+    if (args.threads % (long) count > (long) index)
+        threads++;
+    if (cpus > 0 && threads > cpus)
+        threads = cpus;
+    args.threads = threads < 1 ? 1 : threads;
+
+    // paths are passed on fully resolved, the trim of the coordinator still applies
+    args.flags |= AFLAG_FROM_STDIN | AFLAG_STDIN_NULL | AFLAG_SHARD_WORKER;
+    return run_search();
+}
+
+static int run_coordinator() {
+    if (shard_create(&shard, args.shards, run_shard_worker)) {
+        fprintf(stderr, "failed to start shard workers\n");
+        return 1;
+    }
+
+    put_path = put_shard;
+    load_paths();
+
+    if (shard_finish(&shard)) {
+        // a failing stdout (e.g. piped into head) stops the search quietly
+        if (!shard.stopped)
+            fprintf(stderr, "one or more shard workers failed\n");
+        return 1;
+    }
+
+    print_stats(&shard.stats);
+    return 0;
+}
+
 /*
  * Create options for:
  * - ignore case / regex (impl through a comparator function in place of current check)
  *
  * TODO add:
- * - replace match with alternative (maybe)
  * - logging / verbose mode (including file counting)
  * - snapping previews (preview snaps to the closest space if within certain # chars, will let more whole words come into frame)
  * - space ignoring previews (beginning and trailing spaces will be ignored in previews)
@@ -301,6 +859,7 @@ int main(int argc, char **argv) {
     args.directoryTrim = -1;
     args.flags         = AFLAG_PREVIEW_MATCH | AFLAG_USE_COLOR;
     args.previewBounds = 15;
+    args.cacheSize     = (size_t) 64 << 20;
 
     #ifdef __MINGW32__
     mingw_enable_color();
@@ -308,62 +867,52 @@ int main(int argc, char **argv) {
 
     argp_parse(&arg_parser, argc, argv, 0, 0, NULL);
 
-    // resolve directory
-    args.directory = realpath(args.directory, NULL);
-    if (args.directory == NULL) {
-        fprintf(stderr, "invalid directory\n");
-        return 1;
-    }
-
-    if (args.directoryTrim == -1)
-        args.directoryTrim = (int) strlen(args.directory) + 1;
+    #ifdef __MINGW32__
+    if (args.format == FORMAT_NULL || args.format == FORMAT_BINARY)
+        mingw_binary_stdout();
+    #endif
 
-    // done parsing args, create fifo
-    if (sfifo_create(&fifo, args.fifoSize, PATH_MAX)) {
-        fprintf(stderr, "insufficient memory or other resources\n");
+    if (args.flags & AFLAG_REPLACE) {
+        #ifdef __MINGW32__
+        fprintf(stderr, "replace is not supported on this platform\n");
         return 1;
+        #endif
+
+        // an empty query matches everywhere without ever advancing
+        if (args.query[0] == '\0') {
+            fprintf(stderr, "replace can not be used with an empty query\n");
+            return 1;
+        }
     }
 
-    if (args.threads < 1) {
-        fprintf(stderr, "invalid processor configuration, 2 or more cores is required\n");
-        return 1;
+    if (args.flags & AFLAG_STDIN_CONTENT) {
+        if (args.flags & AFLAG_REPLACE) {
+            fprintf(stderr, "replace can not be used with stdin content\n");
+            return 1;
+        }
+        return search_stdin();
     }
 
-    // init threads
-    pthread_t* threads = malloc(sizeof(pthread_t) * args.threads);
-    for (int i = 0; i < args.threads; i++) {
-        pthread_create(&threads[i], NULL, task_search, NULL);
+    // resolve directory
+    args.directory = realpath(args.directory, NULL);
+    if (args.directory == NULL) {
+        fprintf(stderr, "invalid directory\n");
+        return 1;
     }
 
-    // iterate files and send them to the fifo
     if (args.flags & AFLAG_FROM_STDIN) {
         // just ignore dir trim all together for now
         args.directoryTrim = 0;
-
-        char* lineBuffer = NULL;
-        size_t lineBufferSize = 0;
-        ssize_t lineLen;
-
-        while ((lineLen = getline(&lineBuffer, &lineBufferSize, stdin)) != EOF) {
-            lineBuffer[lineLen - 1] = 0;
-
-            struct stat fstatus;
-            if (!stat(lineBuffer, &fstatus) && S_ISREG(fstatus.st_mode)) { // todo add symlinks later (if add follow symlinks opt)
-                while (sfifo_put(&fifo, lineBuffer));
-            }
-        }
-
-        free(lineBuffer);
-    } else {
-        nftw(args.directory, task_load_file_entry, args.maxFileDesc, FTW_PHYS); // max # open file descriptors, do not follow symlinks (todo maybe allow this? as an option)
+    } else if (args.directoryTrim == -1) {
+        args.directoryTrim = (int) strlen(args.directory) + 1;
     }
 
-    // cleanup
-    sfifo_close(&fifo); // ensure it is closed before joining threads
-    for (int i = 0; i < args.threads; i++) {
-        pthread_join(threads[i], NULL);
-    }
-    sfifo_free(&fifo);
+    int ret;
+    if (args.shards > 1 && !(args.flags & AFLAG_SHARD_WORKER))
+        ret = run_coordinator();
+    else
+        ret = run_search();
+
     free(args.extensions);
-    return 0;
+    return ret;
 }
\ No newline at end of file
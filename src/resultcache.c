@@ -0,0 +1,436 @@
+/* fastgrep - a multi-threaded tool to search for files containing a pattern
+   Copyright (C) 2020, Andrew Howard, <divisionind.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifndef __MINGW32__
+#include <sys/file.h>
+#include <sys/mman.h>
+#endif
+
+#include "resultcache.h"
+
+#define RCACHE_MAGIC        "FGRCACHE"
+#define RCACHE_VERSION      1
+#define RCACHE_MIN_SIZE     (1 << 20)
+#define RCACHE_BUCKET_RATIO 256  // bytes of cache per hash bucket
+#define ALIGN8(x)           (((x) + 7) & ~((uint64_t) 7))
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t size;        // size of the entire cache file
+    uint64_t nbuckets;    // power of two
+    uint64_t entries;
+    uint64_t data_off;    // start of the record region
+    uint64_t data_used;   // bytes used in the record region
+    uint64_t generation;  // odd while a writer modifies the table
+} rcache_header_t;
+
+typedef struct {
+    uint64_t options_hash;
+    uint64_t path_hash;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t path_len;
+    uint32_t result_len;
+    // followed by path bytes then result bytes, padded to 8
+} rcache_record_t;
+
+struct rcache_pending {
+    rcache_pending_t *next;
+    rcache_record_t record; // written to the cache as is
+    char data[];            // path followed by result
+};
+
+#define HEADER(cache)  ((rcache_header_t*) (cache)->map)
+#define BUCKETS(cache) ((volatile uint64_t*) ((char*) (cache)->map + sizeof(rcache_header_t)))
+
+uint64_t rcache_hash(uint64_t hash, const void *data, size_t len) {
+    // FNV-1a, seed with 0 for a fresh hash
+    const unsigned char *bytes = data;
+    if (hash == 0)
+        hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#ifndef __MINGW32__
+
+int rcache_same_file(const struct stat *a, const struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_dev == b->st_dev && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void cache_reset(rcache_t *cache) {
+    memset((char*) cache->map + sizeof(rcache_header_t), 0, cache->nbuckets * sizeof(uint64_t));
+    HEADER(cache)->entries = 0;
+    HEADER(cache)->data_used = 0;
+}
+
+// only empty files and files which already are (possibly outdated or corrupt) caches may be overwritten
+static int cache_owned(int fd) {
+    struct stat fstatus;
+    char magic[sizeof(RCACHE_MAGIC) - 1];
+
+    if (fstat(fd, &fstatus) || !S_ISREG(fstatus.st_mode))
+        return 0;
+
+    return fstatus.st_size == 0 ||
+           (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && !memcmp(magic, RCACHE_MAGIC, sizeof(magic)));
+}
+
+static int cache_init(int fd, size_t size) {
+    rcache_header_t header;
+    uint64_t nbuckets = 1;
+
+    while (nbuckets < size / RCACHE_BUCKET_RATIO)
+        nbuckets <<= 1;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RCACHE_MAGIC, sizeof(header.magic));
+    header.version = RCACHE_VERSION;
+    header.size = size;
+    header.nbuckets = nbuckets;
+    header.data_off = ALIGN8(sizeof(rcache_header_t) + nbuckets * sizeof(uint64_t));
+
+    // truncate to zero first so the bucket array reads back as empty
+    if (ftruncate(fd, 0) || ftruncate(fd, size))
+        return 1;
+
+    return pwrite(fd, &header, sizeof(header), 0) != sizeof(header);
+}
+
+static void cache_unmap(rcache_t *cache) {
+    if (cache->map != NULL)
+        munmap(cache->map, cache->map_size);
+    cache->map = NULL;
+}
+
+// maps the cache file and validates its header, the caller must hold a flock
+static int cache_map(rcache_t *cache) {
+    struct stat fstatus;
+
+    cache_unmap(cache);
+    if (fstat(cache->fd, &fstatus) || fstatus.st_size < (off_t) sizeof(rcache_header_t))
+        return 1;
+
+    cache->map_size = fstatus.st_size;
+    cache->map = mmap(NULL, cache->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+    if (cache->map == MAP_FAILED) {
+        cache->map = NULL;
+        return 1;
+    }
+
+    rcache_header_t *header = HEADER(cache);
+    if (memcmp(header->magic, RCACHE_MAGIC, sizeof(header->magic)) ||
+        header->version != RCACHE_VERSION ||
+        header->size != cache->map_size ||
+        header->nbuckets == 0 || (header->nbuckets & (header->nbuckets - 1)) ||
+        header->nbuckets > cache->map_size / sizeof(uint64_t) ||
+        header->data_off != ALIGN8(sizeof(rcache_header_t) + header->nbuckets * sizeof(uint64_t)) ||
+        header->data_off >= header->size) {
+        cache_unmap(cache);
+        return 1;
+    }
+
+    // these never change for a valid cache, only data_used has to be re-read and checked
+    cache->nbuckets = header->nbuckets;
+    cache->data_off = header->data_off;
+    return 0;
+}
+
+/*
+ * The cache file is untrusted and may be modified by other processes while it is read, every record is copied out
+ * and checked to lie within the used record region before any of its contents are touched.
+ */
+static const char *record_at(rcache_t *cache, uint64_t off, rcache_record_t *record) {
+    uint64_t data_used = ((volatile rcache_header_t*) cache->map)->data_used;
+    uint64_t data_end = cache->data_off + (data_used < cache->map_size - cache->data_off ? data_used : cache->map_size - cache->data_off);
+
+    if (off < cache->data_off || (off & 7) || off > data_end || data_end - off < sizeof(rcache_record_t))
+        return NULL;
+
+    memcpy(record, (char*) cache->map + off, sizeof(rcache_record_t));
+    if ((uint64_t) record->path_len + record->result_len > data_end - off - sizeof(rcache_record_t))
+        return NULL;
+
+    return (char*) cache->map + off + sizeof(rcache_record_t);
+}
+
+static const char *record_find(rcache_t *cache, uint64_t path_hash, const char *filename, size_t path_len, uint64_t *slot_out, rcache_record_t *record) {
+    volatile uint64_t *buckets = BUCKETS(cache);
+    uint64_t mask = cache->nbuckets - 1;
+    uint64_t slot = (path_hash ^ cache->options_hash) & mask;
+
+    for (uint64_t i = 0; i < cache->nbuckets; i++, slot = (slot + 1) & mask) {
+        uint64_t off = buckets[slot];
+        const char *data;
+
+        *slot_out = slot;
+        if (off == 0)
+            return NULL;
+
+        if ((data = record_at(cache, off, record)) != NULL &&
+            record->options_hash == cache->options_hash &&
+            record->path_hash == path_hash &&
+            record->path_len == path_len &&
+            !memcmp(data, filename, path_len))
+            return data;
+    }
+
+    *slot_out = cache->nbuckets; // table full of other records
+    return NULL;
+}
+
+int rcache_open(rcache_t *cache, const char *path, size_t size, uint64_t options_hash) {
+    int ret = 1;
+
+    if (size < RCACHE_MIN_SIZE)
+        size = RCACHE_MIN_SIZE;
+
+    cache->map = NULL;
+    cache->pending = NULL;
+    cache->pending_size = 0;
+    cache->options_hash = options_hash;
+    cache->start_time = time(NULL);
+
+    if ((cache->fd = open(path, O_RDWR | O_CREAT, 0644)) == -1)
+        return 1;
+
+    // the exclusive lock is only taken when the cache is missing or corrupt and has to be (re)created
+    if (flock(cache->fd, LOCK_SH))
+        goto fail;
+
+    if (cache_map(cache)) {
+        if (flock(cache->fd, LOCK_EX))
+            goto fail;
+
+        if (cache_map(cache)) {
+            // never destroy a file which is not a cache, e.g. a typo in the cache path
+            if (!cache_owned(cache->fd)) {
+                ret = RCACHE_NOT_A_CACHE;
+                goto fail;
+            }
+
+            if (cache_init(cache->fd, size) || cache_map(cache))
+                goto fail;
+        }
+    }
+
+    // no lock is held while searching, lookups detect concurrent writers through the generation counter
+    flock(cache->fd, LOCK_UN);
+    return pthread_mutex_init(&cache->mutex, NULL);
+
+    fail:
+    cache_unmap(cache);
+    close(cache->fd);
+    return ret;
+}
+
+int rcache_lookup(rcache_t *cache, const char *filename, const struct stat *info, stringbuilder_t *result) {
+    rcache_header_t *header = HEADER(cache);
+    size_t path_len = strlen(filename);
+    size_t start = result->offset;
+    rcache_record_t record;
+    uint64_t slot;
+
+    uint64_t generation = __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE);
+    if (generation & 1)
+        return 1;
+
+    const char *data = record_find(cache, rcache_hash(0, filename, path_len), filename, path_len, &slot, &record);
+    if (data == NULL ||
+        record.dev != (uint64_t) info->st_dev ||
+        record.ino != (uint64_t) info->st_ino ||
+        record.size != (uint64_t) info->st_size ||
+        record.mtime_sec != (int64_t) info->st_mtim.tv_sec ||
+        record.mtime_nsec != (int64_t) info->st_mtim.tv_nsec ||
+        sb_append(result, data + path_len, record.result_len))
+        return 1;
+
+    // the result was copied while another process may have been writing, only trust it if nothing changed
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&header->generation, __ATOMIC_RELAXED) != generation) {
+        result->offset = start;
+        return 1;
+    }
+    return 0;
+}
+
+int rcache_store(rcache_t *cache, const char *filename, const struct stat *info, const char *result, size_t len) {
+    // files modified within the last second may be modified again without their mtime changing
+    if (info->st_mtim.tv_sec >= cache->start_time - 1)
+        return 1;
+
+    size_t path_len = strlen(filename);
+    uint64_t record_size = ALIGN8(sizeof(rcache_record_t) + path_len + len);
+
+    // results which would not fit into the record region are dropped by cache_insert() anyway
+    pthread_mutex_lock(&cache->mutex);
+    int full = cache->pending_size + record_size > cache->map_size - cache->data_off;
+    if (!full)
+        cache->pending_size += record_size;
+    pthread_mutex_unlock(&cache->mutex);
+    if (full)
+        return 1;
+
+    rcache_pending_t *entry = malloc(sizeof(rcache_pending_t) + path_len + len);
+    if (entry == NULL)
+        return 1;
+
+    entry->record.options_hash = cache->options_hash;
+    entry->record.path_hash = rcache_hash(0, filename, path_len);
+    entry->record.dev = info->st_dev;
+    entry->record.ino = info->st_ino;
+    entry->record.size = info->st_size;
+    entry->record.mtime_sec = info->st_mtim.tv_sec;
+    entry->record.mtime_nsec = info->st_mtim.tv_nsec;
+    entry->record.path_len = path_len;
+    entry->record.result_len = len;
+    memcpy(entry->data, filename, path_len);
+    memcpy(entry->data + path_len, result, len);
+
+    pthread_mutex_lock(&cache->mutex);
+    entry->next = cache->pending;
+    cache->pending = entry;
+    pthread_mutex_unlock(&cache->mutex);
+    return 0;
+}
+
+static void cache_insert(rcache_t *cache, rcache_pending_t *entry) {
+    rcache_header_t *header = HEADER(cache);
+    volatile uint64_t *buckets = BUCKETS(cache);
+    rcache_record_t *record = &entry->record;
+    uint64_t record_size = ALIGN8(sizeof(rcache_record_t) + record->path_len + record->result_len);
+    uint64_t data_size = cache->map_size - cache->data_off;
+    rcache_record_t existing;
+    uint64_t slot;
+
+    if (record_size > data_size)
+        return;
+
+    // the cache is bounded, once full (or too densely loaded to probe quickly) everything is dropped
+    if (header->data_used > data_size || header->data_used + record_size > data_size ||
+        header->entries >= cache->nbuckets - (cache->nbuckets >> 2))
+        cache_reset(cache);
+
+    if (!record_find(cache, record->path_hash, entry->data, record->path_len, &slot, &existing) && slot == cache->nbuckets) {
+        cache_reset(cache);
+        record_find(cache, record->path_hash, entry->data, record->path_len, &slot, &existing);
+    }
+
+    uint64_t off = cache->data_off + header->data_used;
+    memcpy((char*) cache->map + off, record, sizeof(*record));
+    memcpy((char*) cache->map + off + sizeof(*record), entry->data, record->path_len + record->result_len);
+
+    header->data_used += record_size;
+    if (buckets[slot] == 0)
+        header->entries++;
+    buckets[slot] = off; // replaced records are left as garbage until the next reset
+}
+
+int rcache_close(rcache_t *cache) {
+    int ret = 0;
+    rcache_pending_t *entry = cache->pending;
+
+    if (entry != NULL) {
+        // the cache may have been re-created since it was opened, so map it again under the lock
+        if (flock(cache->fd, LOCK_EX) || cache_map(cache)) {
+            ret = 1;
+        } else {
+            rcache_header_t *header = HEADER(cache);
+
+            // an odd generation means a writer died mid update, the table can not be trusted anymore
+            if (header->generation & 1)
+                cache_reset(cache);
+
+            __atomic_store_n(&header->generation, header->generation | 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+
+            for (; entry != NULL; entry = entry->next)
+                cache_insert(cache, entry);
+
+            __atomic_store_n(&header->generation, header->generation + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    while (cache->pending != NULL) {
+        entry = cache->pending;
+        cache->pending = entry->next;
+        free(entry);
+    }
+
+    cache_unmap(cache);
+    close(cache->fd); // releases the flock
+    pthread_mutex_destroy(&cache->mutex);
+    return ret;
+}
+
+#else
+
+int rcache_same_file(const struct stat *a, const struct stat *b) {
+    (void) a;
+    (void) b;
+    return 0;
+}
+
+int rcache_open(rcache_t *cache, const char *path, size_t size, uint64_t options_hash) {
+    (void) path;
+    (void) size;
+    (void) options_hash;
+
+    cache->map = NULL;
+    return 1;
+}
+
+int rcache_lookup(rcache_t *cache, const char *filename, const struct stat *info, stringbuilder_t *result) {
+    (void) cache;
+    (void) filename;
+    (void) info;
+    (void) result;
+    return 1;
+}
+
+int rcache_store(rcache_t *cache, const char *filename, const struct stat *info, const char *result, size_t len) {
+    (void) cache;
+    (void) filename;
+    (void) info;
+    (void) result;
+    (void) len;
+    return 1;
+}
+
+int rcache_close(rcache_t *cache) {
+    (void) cache;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,74 @@
+/* fastgrep - a multi-threaded tool to search for files containing a pattern
+   Copyright (C) 2020, Andrew Howard, <divisionind.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#ifndef FASTGREP_RESULTCACHE_H
+#define FASTGREP_RESULTCACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "stringbuilder.h"
+
+typedef struct rcache_pending rcache_pending_t;
+
+#define RCACHE_NOT_A_CACHE 2 // rcache_open() refused to overwrite a file which is not a cache
+
+/*
+ * On-disk result cache. Maps (options hash, path, dev, inode, size, mtime) to the exact output that
+ * file produced (an empty result means "no match"). The file is mapped shared and no lock is held
+ * while searching, lookups copy results out and detect concurrent writers through a
+ * generation counter. New results are queued in memory (at most what fits the record region) and
+ * written back under an exclusive flock by rcache_close(). Only empty files and existing caches are
+ * ever (re)initialized.
+ */
+typedef struct {
+    int fd;
+    void *map;
+    size_t map_size;
+    uint64_t nbuckets;
+    uint64_t data_off;
+    uint64_t options_hash;
+    time_t start_time;
+
+    pthread_mutex_t mutex;
+    rcache_pending_t *pending;
+    size_t pending_size;    // bytes the pending results take up as records, bounded by the record region
+} rcache_t;
+
+uint64_t rcache_hash(uint64_t hash, const void *data, size_t len);
+
+int rcache_same_file(const struct stat *a, const struct stat *b);
+
+int rcache_open(rcache_t *cache, const char *path, size_t size, uint64_t options_hash);
+
+int rcache_lookup(rcache_t *cache, const char *filename, const struct stat *info, stringbuilder_t *result);
+
+int rcache_store(rcache_t *cache, const char *filename, const struct stat *info, const char *result, size_t len);
+
+int rcache_close(rcache_t *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //FASTGREP_RESULTCACHE_H
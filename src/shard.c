@@ -0,0 +1,440 @@
+/* fastgrep - a multi-threaded tool to search for files containing a pattern
+   Copyright (C) 2020, Andrew Howard, <divisionind.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#endif
+
+#include "shard.h"
+
+#define MPOL_PREFERRED 1 // from numaif.h, avoids depending on libnuma for a single syscall
+
+static void encode_le(char *out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) {
+        out[i] = (char) (value & 0xFF);
+        value >>= 8;
+    }
+}
+
+static uint64_t decode_le(const char *in, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = bytes; i > 0; i--)
+        value = (value << 8) | (unsigned char) in[i - 1];
+    return value;
+}
+
+int shard_write_frame(FILE *stream, uint32_t type, const void *data, size_t len) {
+    char header[SHARD_HEADER_SIZE];
+    int ret = 0;
+
+    encode_le(header, type, 4);
+    encode_le(header + 4, len, 4);
+
+    // frames from different threads must not interleave
+    #ifndef __MINGW32__
+    flockfile(stream);
+    #else
+    _lock_file(stream);
+    #endif
+    if (fwrite(header, 1, sizeof(header), stream) != sizeof(header) || fwrite(data, 1, len, stream) != len)
+        ret = 1;
+    #ifndef __MINGW32__
+    funlockfile(stream);
+    #else
+    _unlock_file(stream);
+    #endif
+    return ret;
+}
+
+int shard_write_stats(FILE *stream, const shard_stats_t *stats) {
+    char payload[24];
+
+    encode_le(payload, stats->files, 8);
+    encode_le(payload + 8, stats->matched_files, 8);
+    encode_le(payload + 16, stats->bytes_read, 8);
+    return shard_write_frame(stream, SHARD_FRAME_STATS, payload, sizeof(payload));
+}
+
+#ifndef __MINGW32__
+
+// stops the whole search, the workers are killed and the remaining paths are dropped
+static void shard_stop(shard_t *shard) {
+    if (shard->stopped)
+        return;
+
+    shard->stopped = true;
+    for (size_t i = 0; i < shard->count; i++)
+        kill(shard->workers[i].pid, SIGTERM);
+}
+
+static void collect_frames(shard_t *shard, shard_worker_t *worker) {
+    stringbuilder_t *pending = worker->pending;
+    size_t pos = 0;
+
+    while (pending->offset - pos >= SHARD_HEADER_SIZE) {
+        uint32_t type = decode_le(pending->buffer + pos, 4);
+        uint32_t len = decode_le(pending->buffer + pos + 4, 4);
+        if (pending->offset - pos - SHARD_HEADER_SIZE < len)
+            break;
+
+        char *payload = pending->buffer + pos + SHARD_HEADER_SIZE;
+        if (type == SHARD_FRAME_OUTPUT) {
+            if (!shard->stopped && fwrite(payload, 1, len, stdout) != len)
+                shard_stop(shard);
+        } else if (type == SHARD_FRAME_STATS && len == 24) {
+            shard->stats.files += decode_le(payload, 8);
+            shard->stats.matched_files += decode_le(payload + 8, 8);
+            shard->stats.bytes_read += decode_le(payload + 16, 8);
+        } else {
+            shard->error = 1;
+        }
+        pos += SHARD_HEADER_SIZE + len;
+    }
+
+    memmove(pending->buffer, pending->buffer + pos, pending->offset - pos);
+    pending->offset -= pos;
+}
+
+static void *task_collect(void *context) {
+    shard_t *shard = context;
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * shard->count);
+    size_t open = shard->count;
+    char buffer[65536];
+
+    if (fds == NULL) {
+        shard->error = 1;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < shard->count; i++) {
+        fds[i].fd = shard->workers[i].results;
+        fds[i].events = POLLIN;
+    }
+
+    while (open) {
+        if (poll(fds, shard->count, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            shard->error = 1;
+            break;
+        }
+
+        for (size_t i = 0; i < shard->count; i++) {
+            if (fds[i].fd < 0 || !fds[i].revents)
+                continue;
+
+            shard_worker_t *worker = &shard->workers[i];
+            ssize_t n = read(fds[i].fd, buffer, sizeof(buffer));
+            if (n > 0) {
+                if (sb_append(worker->pending, buffer, n))
+                    shard->error = 1;
+                collect_frames(shard, worker);
+            } else if (n == 0 || errno != EINTR) {
+                // a worker which exits mid frame is treated as failed
+                if (n < 0 || worker->pending->offset)
+                    shard->error = 1;
+
+                close(fds[i].fd);
+                fds[i].fd = -1; // ignored by poll from now on
+                open--;
+            }
+        }
+    }
+
+    if (!shard->stopped && fflush(stdout))
+        shard_stop(shard);
+    free(fds);
+    return NULL;
+}
+
+int shard_create(shard_t *shard, size_t count, int (*worker)(size_t index, size_t count)) {
+    shard->count = 0;
+    shard->next = 0;
+    shard->error = 0;
+    shard->stopped = false;
+    memset(&shard->stats, 0, sizeof(shard->stats));
+
+    shard->workers = calloc(count, sizeof(shard_worker_t));
+    shard->pollfds = malloc(sizeof(struct pollfd) * count);
+    shard->batch = sb_create(PIPE_BUF);
+    if (shard->workers == NULL || shard->pollfds == NULL || shard->batch == NULL) {
+        free(shard->workers);
+        free(shard->pollfds);
+        sb_free(shard->batch);
+        return 1;
+    }
+
+    // a worker dying must not take the coordinator with it, also nothing buffered may be duplicated by fork()
+    signal(SIGPIPE, SIG_IGN);
+    fflush(stdout);
+    fflush(stderr);
+
+    for (size_t i = 0; i < count; i++) {
+        int in[2], out[2];
+        stringbuilder_t *pending = sb_create(65536);
+
+        if (pending == NULL)
+            goto fail;
+
+        if (pipe(in)) {
+            sb_free(pending);
+            goto fail;
+        }
+
+        if (pipe(out)) {
+            close(in[0]);
+            close(in[1]);
+            sb_free(pending);
+            goto fail;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            // the worker must not hold the pipes of the others, or they would never see EOF
+            for (size_t j = 0; j < i; j++) {
+                close(shard->workers[j].paths);
+                close(shard->workers[j].results);
+            }
+
+            signal(SIGPIPE, SIG_DFL);
+            dup2(in[0], STDIN_FILENO);
+            dup2(out[1], STDOUT_FILENO);
+            close(in[0]);
+            close(in[1]);
+            close(out[0]);
+            close(out[1]);
+            exit(worker(i, count));
+        }
+
+        close(in[0]);
+        close(out[1]);
+        if (pid == -1) {
+            close(in[1]);
+            close(out[0]);
+            sb_free(pending);
+            goto fail;
+        }
+
+        // paths queue up in the worker's fifo rather than the pipe, so a busy worker holds as few of them as possible
+        #ifdef F_SETPIPE_SZ
+        fcntl(in[1], F_SETPIPE_SZ, 2 * PIPE_BUF);
+        #endif
+        fcntl(in[1], F_SETFL, fcntl(in[1], F_GETFL) | O_NONBLOCK);
+
+        shard->workers[i].pid = pid;
+        shard->workers[i].paths = in[1];
+        shard->workers[i].results = out[0];
+        shard->workers[i].pending = pending;
+        shard->count++;
+    }
+
+    if (pthread_create(&shard->collector, NULL, task_collect, shard))
+        goto fail;
+
+    return 0;
+
+    fail:
+    for (size_t i = 0; i < shard->count; i++) {
+        close(shard->workers[i].paths);
+        close(shard->workers[i].results);
+        waitpid(shard->workers[i].pid, NULL, 0);
+        sb_free(shard->workers[i].pending);
+    }
+    free(shard->workers);
+    free(shard->pollfds);
+    sb_free(shard->batch);
+    return 1;
+}
+
+/*
+ * Hands the batch to the next worker with room in its pipe, waiting only when every worker is busy. A batch is at
+ * most PIPE_BUF bytes, so the non-blocking write either takes all of it or nothing.
+ */
+static int flush_batch(shard_t *shard) {
+    stringbuilder_t *batch = shard->batch;
+
+    while (batch->offset) {
+        size_t alive = 0;
+
+        for (size_t k = 0; k < shard->count && !shard->stopped; k++) {
+            size_t index = (shard->next + k) % shard->count;
+            shard_worker_t *worker = &shard->workers[index];
+            if (worker->paths < 0)
+                continue;
+
+            ssize_t n = write(worker->paths, batch->buffer, batch->offset);
+            if (n == (ssize_t) batch->offset) {
+                shard->next = (index + 1) % shard->count;
+                sb_reset(batch);
+                return 0;
+            }
+
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                shard->pollfds[alive].fd = worker->paths;
+                shard->pollfds[alive].events = POLLOUT;
+                alive++;
+                continue;
+            }
+
+            // the worker exited
+            close(worker->paths);
+            worker->paths = -1;
+            shard->error = 1;
+        }
+
+        if (shard->stopped || alive == 0)
+            return 1;
+
+        if (poll(shard->pollfds, alive, -1) < 0 && errno != EINTR)
+            return 1;
+    }
+
+    return 0;
+}
+
+int shard_put(shard_t *shard, const char *path) {
+    size_t len = strlen(path) + 1;
+
+    if (shard->stopped)
+        return 1;
+
+    if (len > PIPE_BUF)
+        return 0; // longer than PATH_MAX, the workers could not search it anyway
+
+    if (shard->batch->offset + len > PIPE_BUF && flush_batch(shard))
+        return 1;
+
+    return sb_append(shard->batch, path, len);
+}
+
+int shard_finish(shard_t *shard) {
+    int status;
+
+    if (flush_batch(shard))
+        shard->error = 1;
+
+    // EOF on their stdin lets the workers finish, the collector exits once all of them closed their stdout
+    for (size_t i = 0; i < shard->count; i++) {
+        if (shard->workers[i].paths >= 0)
+            close(shard->workers[i].paths);
+    }
+
+    pthread_join(shard->collector, NULL);
+
+    for (size_t i = 0; i < shard->count; i++) {
+        if (waitpid(shard->workers[i].pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+            shard->error = 1;
+        sb_free(shard->workers[i].pending);
+    }
+
+    free(shard->workers);
+    free(shard->pollfds);
+    sb_free(shard->batch);
+    return shard->error || shard->stopped;
+}
+
+int shard_pin(size_t index) {
+    char path[64];
+    size_t nodes = 0;
+
+    // nodes are assumed to be numbered contiguously from 0
+    for (;; nodes++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu", nodes);
+        if (access(path, F_OK))
+            break;
+    }
+
+    if (nodes == 0)
+        return 0;
+
+    size_t node = index % nodes;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist", node);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+
+    // cpulist is a comma separated list of ranges, e.g. "0-15,64-79"
+    cpu_set_t set;
+    unsigned int start, stop;
+    int c;
+
+    CPU_ZERO(&set);
+    while (fscanf(file, "%u", &start) == 1) {
+        stop = start;
+        if ((c = fgetc(file)) == '-') {
+            if (fscanf(file, "%u", &stop) != 1)
+                break;
+            c = fgetc(file);
+        }
+
+        for (unsigned int cpu = start; cpu <= stop && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &set);
+
+        if (c != ',')
+            break;
+    }
+    fclose(file);
+
+    if (CPU_COUNT(&set) == 0 || sched_setaffinity(0, sizeof(set), &set))
+        return 0;
+
+    // prefer memory from this node, failing is fine as first touch allocation from the pinned cpus mostly does the same
+    if (node < sizeof(unsigned long) * 8 - 1) {
+        unsigned long mask = 1UL << node;
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8);
+    }
+
+    return CPU_COUNT(&set);
+}
+
+#else
+
+int shard_create(shard_t *shard, size_t count, int (*worker)(size_t index, size_t count)) {
+    (void) shard;
+    (void) count;
+    (void) worker;
+    return 1;
+}
+
+int shard_put(shard_t *shard, const char *path) {
+    (void) shard;
+    (void) path;
+    return 1;
+}
+
+int shard_finish(shard_t *shard) {
+    (void) shard;
+    return 1;
+}
+
+int shard_pin(size_t index) {
+    (void) index;
+    return 0;
+}
+
+#endif
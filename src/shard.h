@@ -0,0 +1,89 @@
+/* fastgrep - a multi-threaded tool to search for files containing a pattern
+   Copyright (C) 2020, Andrew Howard, <divisionind.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#ifndef FASTGREP_SHARD_H
+#define FASTGREP_SHARD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#ifndef __MINGW32__
+#include <poll.h>
+#else
+struct pollfd;
+#endif
+
+#include "stringbuilder.h"
+
+/*
+ * Worker protocol: the worker reads NUL-terminated paths on stdin and writes frames to stdout. Each frame is
+ * a little endian u32 type and u32 payload length followed by the payload. Output frames carry the complete
+ * output of one file, the final stats frame carries shard_stats_t as three little endian u64.
+ */
+#define SHARD_FRAME_OUTPUT 1
+#define SHARD_FRAME_STATS  2
+#define SHARD_HEADER_SIZE  8
+
+typedef struct {
+    uint64_t files;         // files searched (including cache hits)
+    uint64_t matched_files;
+    uint64_t bytes_read;
+} shard_stats_t;
+
+typedef struct {
+    pid_t pid;
+    int paths;              // non-blocking write end of the worker's stdin, -1 once closed
+    int results;            // read end of the worker's stdout
+    stringbuilder_t *pending; // partially received frames
+} shard_worker_t;
+
+typedef struct {
+    shard_worker_t *workers;
+    size_t count;
+    size_t next;
+    stringbuilder_t *batch; // paths not yet handed to a worker, at most PIPE_BUF bytes
+    struct pollfd *pollfds;
+    pthread_t collector;
+    shard_stats_t stats;
+    int error;
+    volatile bool stopped;  // stdout failed, e.g. the reader of a pipe exited
+} shard_t;
+
+int shard_create(shard_t *shard, size_t count, int (*worker)(size_t index, size_t count));
+
+int shard_put(shard_t *shard, const char *path);
+
+int shard_finish(shard_t *shard);
+
+int shard_pin(size_t index);
+
+int shard_write_frame(FILE *stream, uint32_t type, const void *data, size_t len);
+
+int shard_write_stats(FILE *stream, const shard_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //FASTGREP_SHARD_H
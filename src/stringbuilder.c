@@ -39,8 +39,18 @@ stringbuilder_t *sb_create(size_t size) {
 int sb_append(stringbuilder_t *sb, const char *content, size_t len) {
     size_t newOffset = sb->offset + len;
     if (newOffset > sb->buffer_size) {
-        newOffset = sb->buffer_size;
-        len = sb->buffer_size - sb->offset;
+        // grow by at least double to keep repeated appends linear
+        size_t newSize = sb->buffer_size * 2;
+        if (newSize < newOffset)
+            newSize = newOffset;
+
+        char *newBuffer = realloc(sb->buffer, newSize + 1);
+        if (newBuffer == NULL)
+            return 1;
+
+        sb->buffer = newBuffer;
+        sb->buffer_size = newSize;
+        sb->buffer[newSize] = 0;
     }
 
     memcpy(sb->buffer + sb->offset, content, len);
@@ -48,6 +58,104 @@ int sb_append(stringbuilder_t *sb, const char *content, size_t len) {
     return 0;
 }
 
+int sb_append_uint(stringbuilder_t *sb, uint64_t value) {
+    char digits[20];
+    size_t i = sizeof(digits);
+
+    do {
+        digits[--i] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    return sb_append(sb, digits + i, sizeof(digits) - i);
+}
+
+// length of the valid UTF-8 sequence starting at content, 0 if it is invalid (overlong, surrogate, truncated, ...)
+static size_t utf8_length(const unsigned char *content, size_t len) {
+    unsigned char lead = content[0];
+    uint32_t codepoint, min;
+    size_t n;
+
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        n = 2;
+        min = 0x80;
+    } else if ((lead & 0xF0) == 0xE0) {
+        n = 3;
+        min = 0x800;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        n = 4;
+        min = 0x10000;
+    } else {
+        return 0;
+    }
+
+    if (n > len)
+        return 0;
+
+    codepoint = lead & (0x7F >> n);
+    for (size_t i = 1; i < n; i++) {
+        if ((content[i] & 0xC0) != 0x80)
+            return 0;
+        codepoint = (codepoint << 6) | (content[i] & 0x3F);
+    }
+
+    if (codepoint < min || codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF))
+        return 0;
+    return n;
+}
+
+int sb_append_json(stringbuilder_t *sb, const char *content, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t start = 0;
+
+    // copy runs of safe characters at once, only escaping quotes, backslashes, control characters and invalid UTF-8
+    for (size_t i = 0; i < len; i++) {
+        unsigned char current = content[i];
+        if (current >= 0x20 && current < 0x80 && current != '"' && current != '\\')
+            continue;
+
+        size_t n;
+        if (current >= 0x80 && (n = utf8_length((const unsigned char*) content + i, len - i))) {
+            i += n - 1;
+            continue;
+        }
+
+        if (sb_append(sb, content + start, i - start))
+            return 1;
+        start = i + 1;
+
+        char escape[6] = {'\\', 'u', '0', '0', hex[current >> 4], hex[current & 0xF]};
+        if (current >= 0x80) {
+            // paths do not have to be UTF-8 on Linux, bytes that are not valid UTF-8 become U+FFFD
+            if (sb_append(sb, "\\ufffd", 6))
+                return 1;
+        } else if (current == '"' || current == '\\') {
+            escape[1] = (char) current;
+            if (sb_append(sb, escape, 2))
+                return 1;
+        } else if (sb_append(sb, escape, sizeof(escape))) {
+            return 1;
+        }
+    }
+
+    return sb_append(sb, content + start, len - start);
+}
+
+int sb_append_le(stringbuilder_t *sb, uint64_t value, size_t bytes) {
+    char encoded[8];
+
+    for (size_t i = 0; i < bytes; i++) {
+        encoded[i] = (char) (value & 0xFF);
+        value >>= 8;
+    }
+
+    return sb_append(sb, encoded, bytes);
+}
+
+void sb_reset(stringbuilder_t *sb) {
+    sb->offset = 0;
+}
+
 void sb_free(stringbuilder_t *sb) {
     if (sb != NULL) {
         free(sb->buffer);
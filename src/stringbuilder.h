@@ -22,6 +22,7 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct {
     char *buffer;
@@ -33,6 +34,14 @@ stringbuilder_t *sb_create(size_t size);
 
 int sb_append(stringbuilder_t *sb, const char *content, size_t len);
 
+int sb_append_uint(stringbuilder_t *sb, uint64_t value);
+
+int sb_append_json(stringbuilder_t *sb, const char *content, size_t len);
+
+int sb_append_le(stringbuilder_t *sb, uint64_t value, size_t bytes);
+
+void sb_reset(stringbuilder_t *sb);
+
 void sb_free(stringbuilder_t *sb);
 
 #ifdef __cplusplus